@@ -5,8 +5,16 @@
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
-
-#define MAX_USERS 100
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define USER_RECORDS_FILE "users.dat"
+#define USER_INDEX_FILE "users.idx"
+#define USER_STORE_VERSION 1
+#define USER_INDEX_MIN_SLOTS 1024
 #define USERNAME_LENGTH 50
 #define PASSWORD_LENGTH 50
 #define EMAIL_LENGTH 100
@@ -106,8 +114,33 @@ typedef struct {
     int x, y;
 } ExitPoint;
 
-User users[MAX_USERS];
-int user_count = 0;
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+    uint64_t capacity;
+} UserFileHeader;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t record;
+} UserIndexSlot;
+
+// users.dat holds the records in registration order; users.idx is an
+// open-addressing (linear probing) table of {hash, record + 1} kept at most
+// half full. Both are mapped shared, so an insert is a couple of stores.
+// The index can always be rebuilt from the records, which is what happens
+// when it is missing, stale or out of room.
+typedef struct {
+    int records_fd;
+    int index_fd;
+    UserFileHeader *records_header;
+    User *records;
+    UserFileHeader *index_header;
+    UserIndexSlot *slots;
+} UserStore;
+
+UserStore user_store;
 
 ExitPoint exitPoints[MAX_EXIT_POINTS] = {
     {MAP_WIDTH / 2, 1},
@@ -132,39 +165,197 @@ int is_valid_password(const char *password) {
     return has_upper && has_lower && has_digit && strlen(password) >= 7;
 }
 
-int is_username_taken(const char *username) {
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].username, username) == 0) {
-            return 1;
+uint32_t username_hash(const char *username) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; username[i]; i++) {
+        hash = (hash ^ (unsigned char)username[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void *map_user_file(int fd, uint64_t entries, size_t entry_size, size_t *length) {
+    *length = sizeof(UserFileHeader) + entries * entry_size;
+    if (ftruncate(fd, *length) != 0) return NULL;
+    void *data = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+// Maps a store file, creating it with `capacity` entries if it is empty.
+// A header with no room, or one the file is too short for, is refused.
+void *open_user_file(int fd, const char *magic, uint64_t capacity, size_t entry_size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NULL;
+
+    size_t length;
+    if (st.st_size >= (off_t)sizeof(UserFileHeader)) {
+        UserFileHeader header;
+        if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            memcmp(header.magic, magic, 4) != 0 || header.version != USER_STORE_VERSION ||
+            header.capacity == 0 || header.count > header.capacity ||
+            header.capacity > (SIZE_MAX - sizeof(header)) / entry_size ||
+            (uint64_t)st.st_size < sizeof(header) + header.capacity * entry_size) {
+            return NULL;
         }
+        return map_user_file(fd, header.capacity, entry_size, &length);
     }
-    return 0;
+
+    UserFileHeader *header = map_user_file(fd, capacity, entry_size, &length);
+    if (header) {
+        memcpy(header->magic, magic, 4);
+        header->version = USER_STORE_VERSION;
+        header->count = 0;
+        header->capacity = capacity;
+    }
+    return header;
+}
+
+void unmap_user_file(UserFileHeader *header, size_t entry_size) {
+    if (header) munmap(header, sizeof(UserFileHeader) + header->capacity * entry_size);
+}
+
+void user_index_insert(UserStore *store, uint32_t hash, uint32_t record) {
+    uint64_t mask = store->index_header->capacity - 1;
+    uint64_t slot = hash & mask;
+    while (store->slots[slot].record) {
+        slot = (slot + 1) & mask;
+    }
+    store->slots[slot].hash = hash;
+    store->slots[slot].record = record + 1;
+    store->index_header->count++;
+}
+
+// Rewrites the index for every record, sized to stay at most half full.
+int rebuild_user_index(UserStore *store) {
+    uint64_t capacity = USER_INDEX_MIN_SLOTS;
+    while (capacity < store->records_header->count * 2 + 2) capacity *= 2;
+
+    unmap_user_file(store->index_header, sizeof(UserIndexSlot));
+    store->index_header = NULL;
+    store->slots = NULL;
+    if (ftruncate(store->index_fd, 0) != 0) return 0;
+
+    store->index_header = open_user_file(store->index_fd, "RBUI", capacity, sizeof(UserIndexSlot));
+    if (!store->index_header) return 0;
+    store->slots = (UserIndexSlot *)(store->index_header + 1);
+    for (uint64_t i = 0; i < store->records_header->count; i++) {
+        user_index_insert(store, username_hash(store->records[i].username), (uint32_t)i);
+    }
+    return 1;
+}
+
+int user_store_open(UserStore *store, const char *records_path, const char *index_path) {
+    memset(store, 0, sizeof(*store));
+    store->records_fd = open(records_path, O_RDWR | O_CREAT, 0600);
+    store->index_fd = open(index_path, O_RDWR | O_CREAT, 0600);
+    if (store->records_fd < 0 || store->index_fd < 0) return 0;
+
+    store->records_header = open_user_file(store->records_fd, "RBUS", 64, sizeof(User));
+    if (!store->records_header) return 0;
+    store->records = (User *)(store->records_header + 1);
+
+    // Probing masks with capacity - 1 and needs an empty slot to stop at, so
+    // an index that is not a power of two or over half full is rebuilt too.
+    store->index_header = open_user_file(store->index_fd, "RBUI", USER_INDEX_MIN_SLOTS, sizeof(UserIndexSlot));
+    if (store->index_header) store->slots = (UserIndexSlot *)(store->index_header + 1);
+    if (!store->index_header || store->index_header->count != store->records_header->count ||
+        (store->index_header->capacity & (store->index_header->capacity - 1)) != 0 ||
+        store->index_header->count * 2 > store->index_header->capacity) {
+        return rebuild_user_index(store);
+    }
+    return 1;
+}
+
+void user_store_close(UserStore *store) {
+    unmap_user_file(store->records_header, sizeof(User));
+    unmap_user_file(store->index_header, sizeof(UserIndexSlot));
+    if (store->records_fd >= 0) close(store->records_fd);
+    if (store->index_fd >= 0) close(store->index_fd);
+    memset(store, 0, sizeof(*store));
+    store->records_fd = -1;
+    store->index_fd = -1;
+}
+
+// A slot pointing past the last record means the index no longer matches
+// the records file, so it is rebuilt and the lookup starts over. Stored
+// names are compared within their field, as a damaged one may lack its NUL.
+User *user_store_find(UserStore *store, const char *username) {
+    uint32_t hash = username_hash(username);
+    uint64_t mask = store->index_header->capacity - 1;
+    for (uint64_t slot = hash & mask; store->slots[slot].record; slot = (slot + 1) & mask) {
+        uint32_t record = store->slots[slot].record;
+        if (record > store->records_header->count) {
+            return rebuild_user_index(store) ? user_store_find(store, username) : NULL;
+        }
+        if (store->slots[slot].hash == hash) {
+            User *user = &store->records[record - 1];
+            if (strncmp(user->username, username, USERNAME_LENGTH) == 0) return user;
+        }
+    }
+    return NULL;
+}
+
+// Appends the record before indexing it: a crash in between leaves an index
+// one short, and the count mismatch gets it rebuilt on the next open. When
+// the records file grows, the old mapping stays in use until the new one
+// exists, so a failed grow leaves the store as it was.
+int user_store_add(UserStore *store, const User *user) {
+    UserFileHeader *records = store->records_header;
+    if (records->count == UINT32_MAX) return 0;
+    if (records->count == records->capacity) {
+        uint64_t capacity = records->capacity * 2;
+        size_t length;
+        UserFileHeader *grown = map_user_file(store->records_fd, capacity, sizeof(User), &length);
+        if (!grown) return 0;
+        unmap_user_file(records, sizeof(User));
+        grown->capacity = capacity;
+        store->records_header = grown;
+        store->records = (User *)(grown + 1);
+        records = grown;
+    }
+
+    uint64_t record = records->count;
+    store->records[record] = *user;
+    records->count++;
+
+    if ((store->index_header->count + 1) * 2 > store->index_header->capacity) {
+        return rebuild_user_index(store);
+    }
+    user_index_insert(store, username_hash(user->username), (uint32_t)record);
+    return 1;
+}
+
+int is_username_taken(const char *username) {
+    return user_store_find(&user_store, username) != NULL;
 }
 
 void create_new_user() {
     User new_user;
+    memset(&new_user, 0, sizeof(new_user));
     printf("Enter username: ");
-    scanf("%s", new_user.username);
+    scanf("%49s", new_user.username);
     if (is_username_taken(new_user.username)) {
         printf("Username is already taken.\n");
         return;
     }
 
     printf("Enter password: ");
-    scanf("%s", new_user.password);
+    scanf("%49s", new_user.password);
     if (!is_valid_password(new_user.password)) {
         printf("Password must be at least 7 characters long and contain at least one uppercase letter, one lowercase letter, and one digit.\n");
         return;
     }
 
     printf("Enter email: ");
-    scanf("%s", new_user.email);
+    scanf("%99s", new_user.email);
     if (!is_valid_email(new_user.email)) {
         printf("Invalid email format.\n");
         return;
     }
 
-    users[user_count++] = new_user;
+    if (!user_store_add(&user_store, &new_user)) {
+        printf("Could not save the new user.\n");
+        return;
+    }
     printf("User created successfully!\n");
 }
 
@@ -878,6 +1069,11 @@ int main() {
     Map map;
     Player player;
 
+    if (!user_store_open(&user_store, USER_RECORDS_FILE, USER_INDEX_FILE)) {
+        printf("Could not open the user store (%s, %s).\n", USER_RECORDS_FILE, USER_INDEX_FILE);
+        return 1;
+    }
+
     generate_random_map(&map);
     initialize_player(&player, 1, 1);
     ensure_player_on_floor(&player, &map);
@@ -902,5 +1098,6 @@ int main() {
         }
     }
 
+    user_store_close(&user_store);
     return 0;
 }  
\ No newline at end of file